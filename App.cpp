@@ -9,23 +9,50 @@
 #include <iomanip>
 #include <chrono>
 #include <stdexcept>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <functional>
+#include <tuple>
+#include <ctime>
+#include <cctype>
+#include <csignal>
 
 #ifdef _WIN32
     #include <direct.h>
     #include <windows.h>
     #include <conio.h>
+    #include <process.h>
     #define MKDIR(dir) _mkdir(dir)
     #define STAT _stat
     #define STAT_STRUCT struct _stat
     #define SLEEP(ms) Sleep(ms)
+    #define POPEN _popen
+    #define PCLOSE _pclose
+    #define GETPID _getpid
 #else
     #include <sys/stat.h>
     #include <unistd.h>
     #include <termios.h>
+    #include <dirent.h>
+    #include <sys/wait.h>
+    #ifdef __linux__
+        #include <sys/prctl.h>
+    #endif
     #define MKDIR(dir) mkdir(dir, 0755)
     #define STAT stat
     #define STAT_STRUCT struct stat
     #define SLEEP(ms) usleep(ms * 1000)
+    #define POPEN popen
+    #define PCLOSE pclose
+    #define GETPID getpid
 #endif
 
 using namespace std;
@@ -49,12 +76,44 @@ void waitForKeyPress() {
     cout << endl;
 }
 
+// "<host>-<pid>", unique among processes sharing a directory
+string processTag() {
+    char host[256] = "host";
+    #ifdef _WIN32
+        DWORD size = sizeof(host);
+        GetComputerNameA(host, &size);
+    #else
+        gethostname(host, sizeof(host) - 1);
+    #endif
+    return string(host) + "-" + to_string(GETPID());
+}
+
+string formatBytes(long long bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    double size = static_cast<double>(bytes);
+    int unit = 0;
+    while (size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    ostringstream result;
+    result << fixed << setprecision(unit == 0 ? 0 : 1) << size << " " << units[unit];
+    return result.str();
+}
+
 // ===============================================
 // Custom Exception Classes
 // ===============================================
 class DownloadException : public runtime_error {
+private:
+    bool retryable;
+
 public:
-    DownloadException(const string& message) : runtime_error(message) {}
+    // Not retryable means trying again cannot help, e.g. the target folder is full
+    DownloadException(const string& message, bool canRetry = true)
+        : runtime_error(message), retryable(canRetry) {}
+
+    bool isRetryable() const { return retryable; }
 };
 
 class FileSystemException : public runtime_error {
@@ -90,19 +149,29 @@ public:
     string buildDownloadCommand(const string& downloaderPath, 
                               const string& url, 
                               const string& outputDir,
+                              const string& outputTemplate,
                               int quality = 0,
                               const string& format = "mp4",
-                              bool audioOnly = false) {
+                              bool audioOnly = false,
+                              const string& formatSpec = "",
+                              const string& infoJsonPath = "") {
         
         // Clean all inputs
         string cleanUrl = sanitizeInput(url);
         string cleanPath = escapeForShell(downloaderPath);
-        string cleanOutput = escapeForShell(outputDir + "/%(uploader)s - %(title)s.%(ext)s");
+        // The template is built internally, only the directory comes from the user
+        string cleanOutput = "\"" + sanitizeInput(outputDir) + "/" + outputTemplate + "\"";
         
         string command = cleanPath + " -o " + cleanOutput;
         
+        // Exact format IDs chosen by FormatSelector take precedence over the fallback chain
+        string cleanSpec = sanitizeInput(formatSpec);
+        
         if (audioOnly) {
-            command += " -f \"bestaudio/best\" --extract-audio --audio-format mp3";
+            command += " -f \"" + (cleanSpec.empty() ? "bestaudio/best" : cleanSpec) + "\"";
+            command += " --extract-audio --audio-format mp3";
+        } else if (!cleanSpec.empty()) {
+            command += " -f \"" + cleanSpec + "\" --merge-output-format " + escapeForShell(format);
         } else {
             if (quality == 0) {
                 command += " -f \"best[height<=2160][ext=" + format + "]/best[height<=2160]/best\"";
@@ -112,10 +181,26 @@ public:
         }
         
         command += " --write-info-json --write-thumbnail --embed-subs --write-auto-sub";
-        command += " " + escapeForShell(cleanUrl);
+        
+        // Download from the metadata the formats were selected from instead of extracting again
+        if (!infoJsonPath.empty()) {
+            command += " --load-info-json " + escapeForShell(infoJsonPath);
+        } else {
+            command += " " + escapeForShell(cleanUrl);
+        }
         
         return command;
     }
+    
+    // List the video IDs of a playlist or channel without extracting each video
+    string buildPlaylistCommand(const string& downloaderPath, const string& url) {
+        return escapeForShell(downloaderPath) + " --flat-playlist --print id --no-warnings " + escapeForShell(url);
+    }
+    
+    // Dump the metadata (including the formats table) of a single video as JSON
+    string buildMetadataCommand(const string& downloaderPath, const string& url) {
+        return escapeForShell(downloaderPath) + " -J --no-playlist --no-warnings " + escapeForShell(url);
+    }
 };
 
 // ===============================================
@@ -200,56 +285,1667 @@ public:
         }
     }
 
-    static void makeExecutable(const string& path) {
-        #ifndef _WIN32
-            string chmodCmd = "chmod +x \"" + path + "\"";
-            system(chmodCmd.c_str());
-        #endif
+    static bool isDirectory(const string& path) {
+        STAT_STRUCT buffer;
+        if (STAT(path.c_str(), &buffer) != 0) return false;
+        return (buffer.st_mode & S_IFMT) == S_IFDIR;
+    }
+
+    // Create a directory and all missing parents. Safe to call from several
+    // threads at once: a directory created by someone else in between is fine.
+    static void createDirectories(const string& path) {
+        if (path.empty() || isDirectory(path)) return;
+
+        size_t pos = 0;
+        while (pos != string::npos) {
+            pos = path.find_first_of("/\\", pos + 1);
+            string partial = path.substr(0, pos);
+            if (partial.empty() || isDirectory(partial)) continue;
+            if (MKDIR(partial.c_str()) != 0 && !isDirectory(partial)) {
+                throw FileSystemException("Failed to create directory: " + partial);
+            }
+        }
+    }
+
+    // Names of all entries in a directory (without "." and "..")
+    static vector<string> listDirectory(const string& path) {
+        vector<string> entries;
+        #ifdef _WIN32
+            WIN32_FIND_DATAA data;
+            HANDLE handle = FindFirstFileA((path + "\\*").c_str(), &data);
+            if (handle == INVALID_HANDLE_VALUE) {
+                throw FileSystemException("Failed to read directory: " + path);
+            }
+            do {
+                string name = data.cFileName;
+                if (name != "." && name != "..") entries.push_back(name);
+            } while (FindNextFileA(handle, &data));
+            FindClose(handle);
+        #else
+            DIR* dir = opendir(path.c_str());
+            if (!dir) {
+                throw FileSystemException("Failed to read directory: " + path);
+            }
+            while (struct dirent* entry = readdir(dir)) {
+                string name = entry->d_name;
+                if (name != "." && name != "..") entries.push_back(name);
+            }
+            closedir(dir);
+        #endif
+        return entries;
+    }
+
+    static bool readFile(const string& path, string& content) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return false;
+        ostringstream buffer;
+        buffer << file.rdbuf();
+        content = buffer.str();
+        return true;
+    }
+
+    // Rename that also overwrites an existing target, atomically where the OS allows
+    static bool replaceFile(const string& from, const string& to) {
+        #ifdef _WIN32
+            return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+        #else
+            return rename(from.c_str(), to.c_str()) == 0;
+        #endif
+    }
+
+    static void makeExecutable(const string& path) {
+        #ifndef _WIN32
+            string chmodCmd = "chmod +x \"" + path + "\"";
+            system(chmodCmd.c_str());
+        #endif
+    }
+
+    static void clearScreen() {
+        #ifdef _WIN32
+            system("cls");
+        #else
+            system("clear");
+        #endif
+    }
+
+    static string detectDownloaderPath(bool verboseMode = false) {
+        vector<string> possiblePaths = {
+            #ifdef _WIN32
+                "libs\\yt-dlp.exe",
+                "yt-dlp.exe",
+                "bin\\yt-dlp.exe"
+            #else
+                "./libs/yt-dlp",
+                "./yt-dlp",
+                "/usr/local/bin/yt-dlp",
+                "/usr/bin/yt-dlp",
+                "./bin/yt-dlp"
+            #endif
+        };
+
+        for (const string& path : possiblePaths) {
+            if (fileExists(path)) {
+                if (!isExecutable(path)) {
+                    makeExecutable(path);
+                }
+                if (verboseMode) {
+                    cout << "✅ Found yt-dlp at: " << path << endl;
+                }
+                return path;
+            }
+        }
+
+        // Instead of exit, throw exception
+        string errorMsg = "❌ Error: yt-dlp not found anywhere!\n";
+        errorMsg += "Please install yt-dlp or place it in one of these locations:\n";
+        for (const string& path : possiblePaths) {
+            errorMsg += "  - " + path + "\n";
+        }
+        
+        throw FileSystemException(errorMsg);
+    }
+};
+
+// ===============================================
+// Process Runner Class
+// ===============================================
+// Runs a shell command like system(), but can stop it, together with
+// everything it started (e.g. ffmpeg), as soon as 'cancel' becomes true.
+// On Linux the command is also stopped when this process dies unexpectedly.
+class ProcessRunner {
+private:
+    #ifndef _WIN32
+        static volatile sig_atomic_t currentGroup;
+
+        // Take the child's process group down with us on Ctrl+C, kill or a closed terminal
+        static void forwardSignal(int signal) {
+            if (currentGroup > 0) kill(-currentGroup, SIGTERM);
+            std::signal(signal, SIG_DFL);
+            raise(signal);
+        }
+
+        // Runs in the child that leads the group: passes a termination on to
+        // the whole group, so yt-dlp's own children (ffmpeg) stop as well
+        static void terminateGroup(int) {
+            std::signal(SIGTERM, SIG_IGN);
+            kill(0, SIGTERM);
+        }
+    #endif
+
+public:
+    static const int cancelled = -2;
+
+    static int run(const string& command, const atomic<bool>& cancel) {
+        #ifdef _WIN32
+            HANDLE job = CreateJobObjectA(nullptr, nullptr);
+            JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+            limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+            SetInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+
+            STARTUPINFOA startup = {};
+            startup.cb = sizeof(startup);
+            PROCESS_INFORMATION process = {};
+            string commandLine = "cmd /c \"" + command + "\"";
+            if (!CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, FALSE, CREATE_SUSPENDED,
+                                nullptr, nullptr, &startup, &process)) {
+                CloseHandle(job);
+                return -1;
+            }
+            AssignProcessToJobObject(job, process.hProcess);
+            ResumeThread(process.hThread);
+
+            int result = -1;
+            while (WaitForSingleObject(process.hProcess, 200) == WAIT_TIMEOUT) {
+                if (cancel) {
+                    TerminateJobObject(job, 1);
+                    WaitForSingleObject(process.hProcess, INFINITE);
+                    result = cancelled;
+                    break;
+                }
+            }
+            if (result != cancelled) {
+                DWORD exitCode = 1;
+                GetExitCodeProcess(process.hProcess, &exitCode);
+                result = static_cast<int>(exitCode);
+            }
+            CloseHandle(process.hThread);
+            CloseHandle(process.hProcess);
+            CloseHandle(job);
+            return result;
+        #else
+            #ifdef __linux__
+                pid_t parent = getpid();
+            #endif
+            pid_t pid = fork();
+            if (pid < 0) return -1;
+            if (pid == 0) {
+                setpgid(0, 0);
+                std::signal(SIGTERM, terminateGroup);
+                #ifdef __linux__
+                    // Signals can't be forwarded if we die from SIGKILL (e.g. the OOM killer),
+                    // so let the kernel stop the download instead of leaving it orphaned
+                    prctl(PR_SET_PDEATHSIG, SIGTERM);
+                    if (getppid() != parent) _exit(127);
+                #endif
+
+                pid_t shell = fork();
+                if (shell < 0) _exit(127);
+                if (shell == 0) {
+                    execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+                    _exit(127);
+                }
+                int shellStatus = 0;
+                while (waitpid(shell, &shellStatus, 0) < 0 && errno == EINTR) {}
+                _exit(WIFEXITED(shellStatus) ? WEXITSTATUS(shellStatus) : 128 + WTERMSIG(shellStatus));
+            }
+            setpgid(pid, pid);
+
+            currentGroup = pid;
+            auto previousInt = std::signal(SIGINT, forwardSignal);
+            auto previousTerm = std::signal(SIGTERM, forwardSignal);
+            auto previousHup = std::signal(SIGHUP, forwardSignal);
+
+            int status = 0;
+            int result = -1;
+            int graceMs = 0;
+            while (true) {
+                pid_t done = waitpid(pid, &status, WNOHANG);
+                if (done == pid) {
+                    if (graceMs > 0) {
+                        result = cancelled;
+                    } else if (WIFEXITED(status)) {
+                        result = WEXITSTATUS(status);
+                    }
+                    break;
+                }
+                if (done < 0) break;
+
+                if (cancel) {
+                    // Give yt-dlp a few seconds to stop cleanly before killing everything
+                    kill(-pid, graceMs < 5000 ? SIGTERM : SIGKILL);
+                    graceMs += 200;
+                }
+                SLEEP(200);
+            }
+
+            currentGroup = 0;
+            std::signal(SIGINT, previousInt);
+            std::signal(SIGTERM, previousTerm);
+            std::signal(SIGHUP, previousHup);
+            return result;
+        #endif
+    }
+};
+
+#ifndef _WIN32
+    volatile sig_atomic_t ProcessRunner::currentGroup = 0;
+#endif
+
+// ===============================================
+// JSON Helpers
+// ===============================================
+class JsonUtils {
+public:
+    static void appendUtf8(string& out, unsigned int codePoint) {
+        if (codePoint < 0x80) {
+            out += static_cast<char>(codePoint);
+        } else if (codePoint < 0x800) {
+            out += static_cast<char>(0xC0 | (codePoint >> 6));
+            out += static_cast<char>(0x80 | (codePoint & 0x3F));
+        } else if (codePoint < 0x10000) {
+            out += static_cast<char>(0xE0 | (codePoint >> 12));
+            out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (codePoint & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (codePoint >> 18));
+            out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (codePoint & 0x3F));
+        }
+    }
+
+    // Decode a JSON string literal starting at the opening quote.
+    // On success 'pos' points just past the closing quote.
+    static bool decodeString(const string& json, size_t& pos, string& value) {
+        if (pos >= json.size() || json[pos] != '"') return false;
+        value.clear();
+        ++pos;
+        while (pos < json.size()) {
+            char c = json[pos++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                value += c;
+                continue;
+            }
+            if (pos >= json.size()) return false;
+            char esc = json[pos++];
+            switch (esc) {
+                case 'n': value += '\n'; break;
+                case 't': value += '\t'; break;
+                case 'r': value += '\r'; break;
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'u': {
+                    if (pos + 4 > json.size()) return false;
+                    unsigned int codePoint = stoul(json.substr(pos, 4), nullptr, 16);
+                    pos += 4;
+                    // Surrogate pair
+                    if (codePoint >= 0xD800 && codePoint <= 0xDBFF && pos + 6 <= json.size()
+                        && json[pos] == '\\' && json[pos + 1] == 'u') {
+                        unsigned int low = stoul(json.substr(pos + 2, 4), nullptr, 16);
+                        codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                        pos += 6;
+                    }
+                    appendUtf8(value, codePoint);
+                    break;
+                }
+                default: value += esc; break;
+            }
+        }
+        return false;
+    }
+
+    // Find the first string value stored under 'key'. Good enough for the
+    // top-level fields of a yt-dlp .info.json, which come before nested ones.
+    static bool findString(const string& json, const string& key, string& value) {
+        string needle = "\"" + key + "\"";
+        size_t pos = 0;
+        while ((pos = json.find(needle, pos)) != string::npos) {
+            pos += needle.size();
+            size_t colon = json.find_first_not_of(" \t\r\n", pos);
+            if (colon == string::npos || json[colon] != ':') continue;
+            size_t start = json.find_first_not_of(" \t\r\n", colon + 1);
+            if (start == string::npos || json[start] != '"') continue;
+            return decodeString(json, start, value);
+        }
+        return false;
+    }
+};
+
+// Minimal JSON document model, enough to read yt-dlp metadata
+class JsonValue {
+public:
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    vector<JsonValue> items;      // Array elements
+    vector<string> keys;          // Object member names
+    vector<JsonValue> values;     // Object member values
+
+    static JsonValue parse(const string& json) {
+        size_t pos = 0;
+        JsonValue value = parseValue(json, pos);
+        return value;
+    }
+
+    const JsonValue* get(const string& key) const {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i] == key) return &values[i];
+        }
+        return nullptr;
+    }
+
+    string getString(const string& key, const string& fallback = "") const {
+        const JsonValue* value = get(key);
+        return (value && value->type == Type::String) ? value->text : fallback;
+    }
+
+    double getNumber(const string& key, double fallback = 0) const {
+        const JsonValue* value = get(key);
+        return (value && value->type == Type::Number) ? value->number : fallback;
+    }
+
+private:
+    static void skipWhitespace(const string& json, size_t& pos) {
+        while (pos < json.size() && isspace(static_cast<unsigned char>(json[pos]))) ++pos;
+    }
+
+    static void expectLiteral(const string& json, size_t& pos, const string& literal) {
+        if (json.compare(pos, literal.size(), literal) != 0) {
+            throw runtime_error("Invalid JSON near offset " + to_string(pos));
+        }
+        pos += literal.size();
+    }
+
+    static JsonValue parseValue(const string& json, size_t& pos) {
+        skipWhitespace(json, pos);
+        if (pos >= json.size()) throw runtime_error("Unexpected end of JSON");
+
+        JsonValue value;
+        char c = json[pos];
+        if (c == '{') {
+            value.type = Type::Object;
+            ++pos;
+            skipWhitespace(json, pos);
+            if (pos < json.size() && json[pos] == '}') { ++pos; return value; }
+            while (true) {
+                skipWhitespace(json, pos);
+                string key;
+                if (!JsonUtils::decodeString(json, pos, key)) {
+                    throw runtime_error("Invalid JSON object key near offset " + to_string(pos));
+                }
+                skipWhitespace(json, pos);
+                expectLiteral(json, pos, ":");
+                value.keys.push_back(key);
+                value.values.push_back(parseValue(json, pos));
+                skipWhitespace(json, pos);
+                if (pos < json.size() && json[pos] == ',') { ++pos; continue; }
+                expectLiteral(json, pos, "}");
+                return value;
+            }
+        } else if (c == '[') {
+            value.type = Type::Array;
+            ++pos;
+            skipWhitespace(json, pos);
+            if (pos < json.size() && json[pos] == ']') { ++pos; return value; }
+            while (true) {
+                value.items.push_back(parseValue(json, pos));
+                skipWhitespace(json, pos);
+                if (pos < json.size() && json[pos] == ',') { ++pos; continue; }
+                expectLiteral(json, pos, "]");
+                return value;
+            }
+        } else if (c == '"') {
+            value.type = Type::String;
+            if (!JsonUtils::decodeString(json, pos, value.text)) {
+                throw runtime_error("Unterminated JSON string");
+            }
+        } else if (c == 't') {
+            expectLiteral(json, pos, "true");
+            value.type = Type::Bool;
+            value.boolean = true;
+        } else if (c == 'f') {
+            expectLiteral(json, pos, "false");
+            value.type = Type::Bool;
+        } else if (c == 'n') {
+            expectLiteral(json, pos, "null");
+        } else {
+            const char* start = json.c_str() + pos;
+            char* end = nullptr;
+            value.number = strtod(start, &end);
+            if (end == start) throw runtime_error("Invalid JSON near offset " + to_string(pos));
+            value.type = Type::Number;
+            pos += end - start;
+        }
+        return value;
+    }
+};
+
+// ===============================================
+// Output Layout Class
+// ===============================================
+class LayoutException : public runtime_error {
+public:
+    LayoutException(const string& message) : runtime_error(message) {}
+};
+
+// Describes how files are arranged inside the download directory.
+// "flat" keeps the old single-folder behaviour, while a spec such as
+// "uploader/date/id2" shards by uploader, then upload year and month,
+// then the first two characters of the video ID. No folder of a sharded
+// library may hold more than maxEntriesPerDirectory entries.
+class OutputLayout {
+public:
+    enum class Level { Uploader, Year, Month, IdPrefix };
+
+    static const int maxIdPrefixLength = 4;
+
+private:
+    vector<Level> levels;
+    int idPrefixLength = 2;
+    size_t maxEntriesPerDirectory = 10000;
+
+    void addLevel(Level level, const string& token) {
+        if (find(levels.begin(), levels.end(), level) != levels.end()) {
+            throw LayoutException("Layout level used twice: " + token);
+        }
+        levels.push_back(level);
+    }
+
+public:
+    static string fileNameTemplate() {
+        return "%(uploader)s - %(title)s.%(ext)s";
+    }
+
+    // Layout settings are stored inside the library they describe
+    static string settingsFile(const string& libraryDir) {
+        return libraryDir + "/.layout";
+    }
+
+    // Same character replacements yt-dlp applies to template fields
+    static string folderName(const string& value) {
+        string result;
+        for (unsigned char c : value) {
+            if (c == '/') {
+                JsonUtils::appendUtf8(result, 0x29F8);
+            } else if (c == '\\') {
+                JsonUtils::appendUtf8(result, 0x29F9);
+            } else if (string("\"*:<>?|").find(c) != string::npos) {
+                JsonUtils::appendUtf8(result, c + 0xFEE0);
+            } else if (c >= 32 && c != 127) {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    // Saved layout of a library, or the flat default if there is none
+    static OutputLayout load(const string& libraryDir) {
+        OutputLayout layout;
+        ifstream file(settingsFile(libraryDir));
+        string line;
+        while (getline(file, line)) {
+            size_t separator = line.find('=');
+            if (separator == string::npos) continue;
+            string key = line.substr(0, separator);
+            string value = line.substr(separator + 1);
+            try {
+                if (key == "layout") {
+                    size_t maxEntries = layout.maxEntriesPerDirectory;
+                    layout = fromSpec(value);
+                    layout.maxEntriesPerDirectory = maxEntries;
+                } else if (key == "max_entries" && !value.empty()) {
+                    layout.maxEntriesPerDirectory = stoul(value);
+                }
+            } catch (const exception& e) {
+                cerr << "⚠️  Ignoring invalid " << key << " in " << settingsFile(libraryDir)
+                     << ": " << e.what() << endl;
+            }
+        }
+        return layout;
+    }
+
+    void save(const string& libraryDir) const {
+        ofstream file(settingsFile(libraryDir), ios::trunc);
+        if (!file.is_open()) {
+            throw FileSystemException("Failed to save layout: " + settingsFile(libraryDir));
+        }
+        file << "layout=" << toSpec() << "\n"
+             << "max_entries=" << maxEntriesPerDirectory << "\n";
+    }
+
+    static OutputLayout fromSpec(const string& spec) {
+        OutputLayout layout;
+        if (spec.empty() || spec == "flat") return layout;
+
+        stringstream stream(spec);
+        string token;
+        while (getline(stream, token, '/')) {
+            if (token == "uploader") {
+                layout.addLevel(Level::Uploader, token);
+            } else if (token == "year") {
+                layout.addLevel(Level::Year, token);
+            } else if (token == "month") {
+                layout.addLevel(Level::Month, token);
+            } else if (token == "date") {
+                layout.addLevel(Level::Year, token);
+                layout.addLevel(Level::Month, token);
+            } else if (regex_match(token, regex(R"(id[1-4])"))) {
+                layout.addLevel(Level::IdPrefix, token);
+                layout.idPrefixLength = token[2] - '0';
+            } else {
+                throw LayoutException("Unknown layout level: '" + token + "'\n"
+                                      "Valid levels: uploader, year, month, date, id1-id4");
+            }
+        }
+        return layout;
+    }
+
+    string toSpec() const {
+        if (levels.empty()) return "flat";
+        string spec;
+        for (Level level : levels) {
+            if (!spec.empty()) spec += "/";
+            switch (level) {
+                case Level::Uploader: spec += "uploader"; break;
+                case Level::Year: spec += "year"; break;
+                case Level::Month: spec += "month"; break;
+                case Level::IdPrefix: spec += "id" + to_string(idPrefixLength); break;
+            }
+        }
+        return spec;
+    }
+
+    bool isFlat() const { return levels.empty(); }
+
+    // Depth of the folder whose entries are the ID prefix folders, -1 without that level
+    int idPrefixDepth() const {
+        auto it = find(levels.begin(), levels.end(), Level::IdPrefix);
+        return it == levels.end() ? -1 : static_cast<int>(it - levels.begin());
+    }
+
+    int getIdPrefixLength() const { return idPrefixLength; }
+    void setIdPrefixLength(int length) { idPrefixLength = length; }
+
+    size_t getMaxEntriesPerDirectory() const { return maxEntriesPerDirectory; }
+    void setMaxEntriesPerDirectory(size_t maxEntries) { maxEntriesPerDirectory = maxEntries; }
+
+    // yt-dlp output template relative to the download directory.
+    // Thumbnails, info.json and subtitles follow the same template.
+    string outputTemplate() const {
+        string result;
+        for (Level level : levels) {
+            switch (level) {
+                case Level::Uploader: result += "%(uploader)s/"; break;
+                case Level::Year: result += "%(upload_date>%Y)s/"; break;
+                case Level::Month: result += "%(upload_date>%m)s/"; break;
+                case Level::IdPrefix: result += "%(id)." + to_string(idPrefixLength) + "s/"; break;
+            }
+        }
+        return result + fileNameTemplate();
+    }
+
+    // Shard directory for an already downloaded video, mirroring outputTemplate().
+    // Missing fields map to "NA", the same placeholder yt-dlp uses.
+    string shardPath(const string& uploaderFolder, const string& uploadDate, const string& videoId) const {
+        string result;
+        for (Level level : levels) {
+            if (!result.empty()) result += "/";
+            switch (level) {
+                case Level::Uploader:
+                    result += uploaderFolder.empty() ? "NA" : uploaderFolder;
+                    break;
+                case Level::Year:
+                    result += uploadDate.size() >= 4 ? uploadDate.substr(0, 4) : "NA";
+                    break;
+                case Level::Month:
+                    result += uploadDate.size() >= 6 ? uploadDate.substr(4, 2) : "NA";
+                    break;
+                case Level::IdPrefix:
+                    result += videoId.empty() ? "NA" : videoId.substr(0, idPrefixLength);
+                    break;
+            }
+        }
+        return result;
+    }
+};
+
+// ===============================================
+// Directory Budget Class
+// ===============================================
+// Tracks how many entries every folder of a library will hold once new
+// files are added or existing ones moved away, so a layout can be checked
+// against its per-folder limit before anything is written. The current
+// contents of a folder are read from disk the first time it is touched.
+class DirectoryBudget {
+private:
+    string libraryDir;
+    map<string, set<string>> folders;   // relative path -> entry names
+
+    set<string>& folder(const string& relativeDir) {
+        auto it = folders.find(relativeDir);
+        if (it != folders.end()) return it->second;
+
+        set<string>& names = folders[relativeDir];
+        string path = relativeDir.empty() ? libraryDir : libraryDir + "/" + relativeDir;
+        if (FileSystemManager::isDirectory(path)) {
+            for (const string& name : FileSystemManager::listDirectory(path)) {
+                names.insert(name);
+            }
+        }
+        return names;
+    }
+
+public:
+    DirectoryBudget(const string& dir) : libraryDir(dir) {}
+
+    // Add files to a folder; every folder above it gains at most one subfolder
+    void add(const string& relativeDir, const vector<string>& files) {
+        string parent;
+        size_t start = 0;
+        while (start < relativeDir.size()) {
+            size_t slash = relativeDir.find('/', start);
+            if (slash == string::npos) slash = relativeDir.size();
+            string name = relativeDir.substr(start, slash - start);
+            folder(parent).insert(name);
+            parent = parent.empty() ? name : parent + "/" + name;
+            start = slash + 1;
+        }
+        for (const string& file : files) {
+            folder(relativeDir).insert(file);
+        }
+    }
+
+    void remove(const string& relativeDir, const string& name) {
+        folder(relativeDir).erase(name);
+    }
+
+    // Fullest folder above 'limit'; false if every folder fits
+    bool findOverflow(size_t limit, string& relativeDir, size_t& count) const {
+        bool found = false;
+        for (const auto& entry : folders) {
+            if (entry.second.size() > limit && (!found || entry.second.size() > count)) {
+                relativeDir = entry.first;
+                count = entry.second.size();
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    static int depth(const string& relativeDir) {
+        return relativeDir.empty() ? 0 : static_cast<int>(count(relativeDir.begin(), relativeDir.end(), '/')) + 1;
+    }
+};
+
+// ===============================================
+// Library Migrator Class
+// ===============================================
+struct MigrationReport {
+    size_t videosMoved = 0;
+    size_t filesMoved = 0;
+    size_t filesSkipped = 0;
+    OutputLayout layout;            // layout actually used, the ID prefix may have grown
+    vector<string> errors;
+};
+
+// Re-shards a flat library into the current layout. Every video is found
+// through its .info.json sidecar; all files sharing its base name are moved
+// with plain renames, spread over several threads.
+class LibraryMigrator {
+private:
+    struct LibraryEntry {
+        string uploaderFolder;
+        string uploadDate;
+        string videoId;
+        vector<string> files;
+    };
+
+    struct MigrationTask {
+        string targetDir;
+        vector<string> files;
+    };
+
+    static bool endsWith(const string& str, const string& suffix) {
+        return str.size() >= suffix.size() &&
+               str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // The file name already holds the uploader exactly as yt-dlp wrote it,
+    // so prefer that over re-sanitizing the raw value from info.json.
+    static string uploaderFolderName(const string& baseName, const string& uploader) {
+        string candidate = OutputLayout::folderName(uploader);
+        if (!candidate.empty() && baseName.compare(0, candidate.size() + 3, candidate + " - ") == 0) {
+            return candidate;
+        }
+        size_t separator = baseName.find(" - ");
+        if (separator != string::npos && separator > 0) {
+            return baseName.substr(0, separator);
+        }
+        return candidate;
+    }
+
+    vector<LibraryEntry> collectEntries(const string& libraryDir, MigrationReport& report) {
+        vector<string> names = FileSystemManager::listDirectory(libraryDir);
+        sort(names.begin(), names.end());
+
+        const string infoSuffix = ".info.json";
+        vector<string> baseNames;
+        for (const string& name : names) {
+            if (endsWith(name, infoSuffix)) {
+                baseNames.push_back(name.substr(0, name.size() - infoSuffix.size()));
+            }
+        }
+
+        // Longest base names claim their files first, so "A - B.2" is not
+        // swallowed by "A - B"
+        sort(baseNames.begin(), baseNames.end(), [](const string& a, const string& b) {
+            return a.size() > b.size();
+        });
+
+        vector<bool> claimed(names.size(), false);
+        vector<LibraryEntry> entries;
+
+        for (const string& baseName : baseNames) {
+            string json;
+            string uploader;
+            LibraryEntry entry;
+            if (!FileSystemManager::readFile(libraryDir + "/" + baseName + infoSuffix, json) ||
+                !JsonUtils::findString(json, "id", entry.videoId)) {
+                report.errors.push_back("No video ID in " + baseName + infoSuffix);
+                continue;
+            }
+            JsonUtils::findString(json, "uploader", uploader);
+            JsonUtils::findString(json, "upload_date", entry.uploadDate);
+            entry.uploaderFolder = uploaderFolderName(baseName, uploader);
+
+            string prefix = baseName + ".";
+            auto it = lower_bound(names.begin(), names.end(), prefix);
+            for (; it != names.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+                size_t index = it - names.begin();
+                if (claimed[index] || FileSystemManager::isDirectory(libraryDir + "/" + *it)) continue;
+                claimed[index] = true;
+                entry.files.push_back(*it);
+            }
+
+            entries.push_back(entry);
+        }
+        return entries;
+    }
+
+    vector<MigrationTask> planTasks(const string& libraryDir, const vector<LibraryEntry>& entries,
+                                    const OutputLayout& layout, DirectoryBudget& budget) {
+        vector<MigrationTask> tasks;
+        for (const LibraryEntry& entry : entries) {
+            string shard = layout.shardPath(entry.uploaderFolder, entry.uploadDate, entry.videoId);
+            for (const string& file : entry.files) {
+                budget.remove("", file);
+            }
+            budget.add(shard, entry.files);
+
+            MigrationTask task;
+            task.targetDir = libraryDir + "/" + shard;
+            task.files = entry.files;
+            tasks.push_back(task);
+        }
+        return tasks;
+    }
+
+public:
+    // Moves nothing and throws LayoutException if any folder would end up
+    // over the limit. Overflowing ID prefix folders are fixed by using a
+    // longer prefix where possible.
+    MigrationReport migrate(const string& libraryDir, const OutputLayout& layout, unsigned int threadCount = 0) {
+        MigrationReport report;
+        report.layout = layout;
+        if (layout.isFlat()) {
+            report.errors.push_back("Current layout is flat, nothing to migrate.");
+            return report;
+        }
+
+        vector<LibraryEntry> entries = collectEntries(libraryDir, report);
+        vector<MigrationTask> tasks;
+
+        while (true) {
+            DirectoryBudget budget(libraryDir);
+            tasks = planTasks(libraryDir, entries, report.layout, budget);
+
+            string folder;
+            size_t entryCount = 0;
+            if (!budget.findOverflow(report.layout.getMaxEntriesPerDirectory(), folder, entryCount)) break;
+
+            int prefixDepth = report.layout.idPrefixDepth();
+            if (prefixDepth < 0 || DirectoryBudget::depth(folder) <= prefixDepth ||
+                report.layout.getIdPrefixLength() >= OutputLayout::maxIdPrefixLength) {
+                throw LayoutException("Folder '" + (folder.empty() ? libraryDir : libraryDir + "/" + folder) +
+                                      "' would hold " + to_string(entryCount) + " entries, over the limit of " +
+                                      to_string(report.layout.getMaxEntriesPerDirectory()) +
+                                      ".\nNothing was moved; choose a layout with more levels.");
+            }
+            report.layout.setIdPrefixLength(report.layout.getIdPrefixLength() + 1);
+        }
+
+        if (threadCount == 0) {
+            threadCount = max(2u, thread::hardware_concurrency());
+        }
+        threadCount = min<unsigned int>(threadCount, max<size_t>(tasks.size(), 1));
+
+        atomic<size_t> nextTask(0);
+        mutex reportMutex;
+
+        auto worker = [&]() {
+            size_t index;
+            while ((index = nextTask++) < tasks.size()) {
+                const MigrationTask& task = tasks[index];
+                size_t moved = 0, skipped = 0;
+                vector<string> errors;
+
+                try {
+                    FileSystemManager::createDirectories(task.targetDir);
+                } catch (const exception& e) {
+                    lock_guard<mutex> lock(reportMutex);
+                    report.errors.push_back(e.what());
+                    report.filesSkipped += task.files.size();
+                    continue;
+                }
+
+                for (const string& file : task.files) {
+                    string source = libraryDir + "/" + file;
+                    string target = task.targetDir + "/" + file;
+                    if (FileSystemManager::fileExists(target)) {
+                        errors.push_back("Already exists, skipped: " + target);
+                        skipped++;
+                    } else if (rename(source.c_str(), target.c_str()) != 0) {
+                        errors.push_back("Failed to move " + source + ": " + strerror(errno));
+                        skipped++;
+                    } else {
+                        moved++;
+                    }
+                }
+
+                lock_guard<mutex> lock(reportMutex);
+                report.filesMoved += moved;
+                report.filesSkipped += skipped;
+                if (moved > 0) report.videosMoved++;
+                report.errors.insert(report.errors.end(), errors.begin(), errors.end());
+            }
+        };
+
+        vector<thread> workers;
+        for (unsigned int i = 0; i < threadCount; ++i) {
+            workers.emplace_back(worker);
+        }
+        for (thread& t : workers) {
+            t.join();
+        }
+
+        return report;
+    }
+};
+
+// ===============================================
+// Format Selection Classes
+// ===============================================
+struct MediaFormat {
+    string id;
+    string ext;
+    string vcodec = "none";
+    string acodec = "none";
+    int height = 0;
+    double tbr = 0;        // total bitrate, kbit/s
+    double abr = 0;        // audio bitrate, kbit/s
+    long long filesize = 0;
+
+    bool hasVideo() const { return vcodec != "none"; }
+    bool hasAudio() const { return acodec != "none"; }
+};
+
+struct FormatTable {
+    string videoId;
+    string uploader;
+    string uploadDate;     // YYYYMMDD
+    double duration = 0;   // seconds
+    vector<MediaFormat> formats;
+    string infoJsonPath;   // yt-dlp metadata the table was read from
+    time_t fetchedAt = 0;
+};
+
+struct FormatPolicy {
+    int maxHeight = 2160;
+    string container = "mp4";
+    vector<string> videoCodecs;     // preferred order, empty = container default
+    double maxVideoBitrate = 0;     // kbit/s, 0 = no limit
+    bool audioOnly = false;
+};
+
+struct FormatSelection {
+    string formatSpec;              // e.g. "137+140", empty if nothing fits
+    string description;
+    long long expectedBytes = 0;
+    string infoJsonPath;            // pass to yt-dlp with --load-info-json
+    bool fromCache = false;         // metadata was not fetched for this download
+
+    // Metadata of the video, set whenever its format table was available
+    string videoId;
+    string uploader;
+    string uploadDate;
+
+    bool isValid() const { return !formatSpec.empty(); }
+};
+
+// Picks exact yt-dlp format IDs from the metadata of a video instead of
+// letting yt-dlp evaluate a fallback chain. Format tables are cached per
+// video ID in memory and on disk.
+class FormatSelector {
+private:
+    string downloaderPath;
+    string cacheDir;
+    int cacheLifetimeSeconds;
+    map<string, FormatTable> cache;
+    bool cacheDirPruned = false;
+    SecureCommandBuilder commandBuilder;
+
+    string cacheFile(const string& videoId) const {
+        return cacheDir + "/" + videoId + ".info.json";
+    }
+
+    bool isFresh(time_t fetchedAt) const {
+        return time(nullptr) - fetchedAt <= cacheLifetimeSeconds;
+    }
+
+    // Tables of videos that were never downloaded expire instead of piling up
+    void evictStale() {
+        for (auto it = cache.begin(); it != cache.end();) {
+            it = isFresh(it->second.fetchedAt) ? next(it) : cache.erase(it);
+        }
+    }
+
+    // Files left behind by failed or interrupted downloads, once per process
+    void pruneCacheDir() {
+        if (cacheDirPruned) return;
+        cacheDirPruned = true;
+        for (const string& name : FileSystemManager::listDirectory(cacheDir)) {
+            string path = cacheDir + "/" + name;
+            STAT_STRUCT st;
+            if (STAT(path.c_str(), &st) == 0 && !isFresh(st.st_mtime)) {
+                remove(path.c_str());
+            }
+        }
+    }
+
+    bool loadCachedTable(const string& videoId, FormatTable& table) {
+        STAT_STRUCT st;
+        string path = cacheFile(videoId);
+        string json;
+        if (STAT(path.c_str(), &st) != 0 || !isFresh(st.st_mtime) || !FileSystemManager::readFile(path, json)) {
+            return false;
+        }
+
+        try {
+            table = parseTable(videoId, JsonValue::parse(json));
+        } catch (const exception&) {
+            return false;
+        }
+        table.infoJsonPath = path;
+        table.fetchedAt = st.st_mtime;
+        return !table.formats.empty();
+    }
+
+    // Keep the raw metadata so the download can reuse it with --load-info-json
+    void saveInfoJson(const string& videoId, const string& json, FormatTable& table) {
+        try {
+            FileSystemManager::createDirectories(cacheDir);
+            pruneCacheDir();
+        } catch (const exception&) {
+            return; // The cache is optional
+        }
+
+        string path = cacheFile(videoId);
+        // Several workers may cache the same video at once
+        string tempPath = path + "." + processTag() + ".tmp";
+        ofstream file(tempPath, ios::binary);
+        if (!file.is_open()) return;
+
+        file << json;
+        file.close();
+        if (file && FileSystemManager::replaceFile(tempPath, path)) {
+            table.infoJsonPath = path;
+        } else {
+            remove(tempPath.c_str());
+        }
+    }
+
+    bool fetchTable(const string& videoId, const string& url, FormatTable& table) {
+        string command = commandBuilder.buildMetadataCommand(downloaderPath, url);
+        FILE* pipe = POPEN(command.c_str(), "r");
+        if (!pipe) return false;
+
+        string output;
+        char buffer[65536];
+        size_t bytesRead;
+        while ((bytesRead = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+            output.append(buffer, bytesRead);
+        }
+        if (PCLOSE(pipe) != 0 || output.empty()) return false;
+
+        try {
+            table = parseTable(videoId, JsonValue::parse(output));
+        } catch (const exception&) {
+            return false;
+        }
+        if (table.formats.empty()) return false;
+
+        table.fetchedAt = time(nullptr);
+        saveInfoJson(videoId, output, table);
+        return true;
+    }
+
+    // Lower is better, unknown codecs rank last
+    static int codecRank(const string& codec, const vector<string>& preference) {
+        for (size_t i = 0; i < preference.size(); ++i) {
+            if (codec.compare(0, preference[i].size(), preference[i]) == 0) return static_cast<int>(i);
+        }
+        return static_cast<int>(preference.size());
+    }
+
+    // Whether a stream can go into the target container without re-encoding
+    static bool matchesContainer(const MediaFormat& format, const string& container) {
+        if (container == "mp4") return format.ext == "mp4" || format.ext == "m4a";
+        if (container == "webm") return format.ext == "webm";
+        return true; // mkv takes everything, avi needs a remux either way
+    }
+
+    static vector<string> defaultVideoCodecs(const string& container) {
+        if (container == "mp4") return {"avc1", "av01", "vp09", "vp9"};
+        if (container == "webm") return {"vp09", "vp9", "av01"};
+        return {"av01", "vp09", "vp9", "avc1"};
+    }
+
+    static vector<string> defaultAudioCodecs(const string& container) {
+        if (container == "mp4") return {"mp4a"};
+        if (container == "webm") return {"opus"};
+        return {"opus", "mp4a"};
+    }
+
+    // Best video stream: highest resolution under the cap, then container
+    // match, then codec preference, then bitrate
+    static const MediaFormat* pickVideo(const vector<MediaFormat>& formats, const FormatPolicy& policy,
+                                        bool withAudio) {
+        vector<string> codecs = policy.videoCodecs.empty() ? defaultVideoCodecs(policy.container)
+                                                           : policy.videoCodecs;
+        const MediaFormat* best = nullptr;
+        auto key = [&](const MediaFormat& f) {
+            return make_tuple(f.height, matchesContainer(f, policy.container),
+                              -codecRank(f.vcodec, codecs), f.tbr);
+        };
+
+        for (const MediaFormat& format : formats) {
+            if (!format.hasVideo() || format.hasAudio() != withAudio) continue;
+            if (format.height > policy.maxHeight) continue;
+            if (policy.maxVideoBitrate > 0 && format.tbr > policy.maxVideoBitrate) continue;
+            if (!best || key(format) > key(*best)) best = &format;
+        }
+        return best;
+    }
+
+    static const MediaFormat* pickAudio(const vector<MediaFormat>& formats, const FormatPolicy& policy) {
+        vector<string> codecs = defaultAudioCodecs(policy.container);
+        const MediaFormat* best = nullptr;
+        auto key = [&](const MediaFormat& f) {
+            bool containerMatch = policy.audioOnly || matchesContainer(f, policy.container);
+            return make_tuple(containerMatch, -codecRank(f.acodec, codecs), max(f.abr, f.tbr));
+        };
+
+        for (const MediaFormat& format : formats) {
+            if (!format.hasAudio() || format.hasVideo()) continue;
+            if (!best || key(format) > key(*best)) best = &format;
+        }
+        return best;
+    }
+
+    static long long expectedSize(const MediaFormat& format, double duration) {
+        if (format.filesize > 0) return format.filesize;
+        return static_cast<long long>(format.tbr * 1000 / 8 * duration);
+    }
+
+    static string describe(const MediaFormat& format) {
+        if (format.hasVideo()) {
+            return to_string(format.height) + "p " + format.vcodec.substr(0, format.vcodec.find('.'))
+                   + " " + format.ext;
+        }
+        return format.acodec.substr(0, format.acodec.find('.')) + " " + format.ext;
+    }
+
+public:
+    // Stream URLs inside the metadata expire after about six hours, so the
+    // cache must be well below that for --load-info-json to keep working
+    FormatSelector(const string& path, const string& cachePath = "cache/formats",
+                   int cacheLifetime = 2 * 60 * 60)
+        : downloaderPath(path), cacheDir(cachePath), cacheLifetimeSeconds(cacheLifetime) {}
+
+    static FormatTable parseTable(const string& videoId, const JsonValue& info) {
+        FormatTable table;
+        table.videoId = videoId;
+        table.uploader = info.getString("uploader");
+        table.uploadDate = info.getString("upload_date");
+        table.duration = info.getNumber("duration");
+
+        const JsonValue* formats = info.get("formats");
+        if (!formats || formats->type != JsonValue::Type::Array) return table;
+
+        for (const JsonValue& entry : formats->items) {
+            MediaFormat format;
+            format.id = entry.getString("format_id");
+            format.ext = entry.getString("ext");
+            format.vcodec = entry.getString("vcodec", "none");
+            format.acodec = entry.getString("acodec", "none");
+            format.height = static_cast<int>(entry.getNumber("height"));
+            format.tbr = entry.getNumber("tbr");
+            format.abr = entry.getNumber("abr");
+            format.filesize = static_cast<long long>(entry.getNumber("filesize", entry.getNumber("filesize_approx")));
+
+            // Storyboards and other entries without media are of no use
+            if (format.id.empty() || (!format.hasVideo() && !format.hasAudio())) continue;
+            table.formats.push_back(format);
+        }
+        return table;
+    }
+
+    // Format table for a video, from memory, disk cache or yt-dlp in that order.
+    // 'fetched' tells whether yt-dlp was asked just now.
+    const FormatTable* getTable(const string& videoId, const string& url, bool& fetched) {
+        fetched = false;
+        auto it = cache.find(videoId);
+        if (it != cache.end() && isFresh(it->second.fetchedAt)) return &it->second;
+
+        FormatTable table;
+        if (!loadCachedTable(videoId, table)) {
+            if (!fetchTable(videoId, url, table)) return nullptr;
+            fetched = true;
+        }
+        evictStale();
+        return &(cache[videoId] = table);
+    }
+
+    // Forget the cached metadata, after its stream URLs stopped working or
+    // once the video is downloaded and the metadata is no longer needed
+    void invalidate(const string& videoId) {
+        cache.erase(videoId);
+        remove(cacheFile(videoId).c_str());
+    }
+
+    static FormatSelection select(const FormatTable& table, const FormatPolicy& policy) {
+        FormatSelection selection;
+        const MediaFormat* audio = pickAudio(table.formats, policy);
+
+        if (policy.audioOnly) {
+            if (audio) {
+                selection.formatSpec = audio->id;
+                selection.description = describe(*audio);
+                selection.expectedBytes = expectedSize(*audio, table.duration);
+            }
+            return selection;
+        }
+
+        const MediaFormat* video = pickVideo(table.formats, policy, false);
+        if (video && audio) {
+            selection.formatSpec = video->id + "+" + audio->id;
+            selection.description = describe(*video) + " + " + describe(*audio);
+            selection.expectedBytes = expectedSize(*video, table.duration) + expectedSize(*audio, table.duration);
+            return selection;
+        }
+
+        // No separate streams, fall back to a combined one
+        const MediaFormat* combined = pickVideo(table.formats, policy, true);
+        if (combined) {
+            selection.formatSpec = combined->id;
+            selection.description = describe(*combined);
+            selection.expectedBytes = expectedSize(*combined, table.duration);
+        }
+        return selection;
+    }
+
+    FormatSelection select(const string& videoId, const string& url, const FormatPolicy& policy) {
+        bool fetched;
+        const FormatTable* table = getTable(videoId, url, fetched);
+        if (!table) return FormatSelection();
+
+        FormatSelection selection = select(*table, policy);
+        if (selection.isValid()) {
+            selection.infoJsonPath = table->infoJsonPath;
+            selection.fromCache = !fetched;
+        }
+        selection.videoId = table->videoId;
+        selection.uploader = table->uploader;
+        selection.uploadDate = table->uploadDate;
+        return selection;
+    }
+};
+
+// ===============================================
+// Shared Work Queue Class
+// ===============================================
+struct QueueJob {
+    string id;
+    string url;
+    int quality = 0;
+    string format = "mp4";
+    bool audioOnly = false;
+    string outputDir = "downloads";
+    string layout;          // empty = layout saved in the output directory
+};
+
+struct JobLease {
+    string jobId;
+    int generation = 0;     // 1 for the first claim, +1 for every reclaim
+};
+
+struct QueueStatus {
+    size_t total = 0;
+    size_t completed = 0;
+    size_t failed = 0;
+    size_t running = 0;
+    size_t waiting = 0;
+};
+
+// A job queue kept in a directory that several processes, possibly on
+// different machines, share. Every folder is sharded by the first two
+// characters of the (hex) job ID, so none grows beyond a few thousand
+// entries even for very large backfills:
+//
+//   jobs/<xx>/<id>.job      job description, removed once the job is done
+//   leases/<xx>/<id>.<n>    n-th claim of a job, holds owner, heartbeat and expiry
+//   done/<xx>/<id>.done     final result, created exactly once
+//
+// Claims rely on exclusive file creation: whoever creates leases/<xx>/<id>.<n+1>
+// owns the job. A lease that is not refreshed before it expires may be
+// reclaimed by creating the next generation. Workers compare expiry times
+// with their own clocks, so the machines need roughly synchronized time.
+class SharedWorkQueue {
+private:
+    string queueDir;
+    string workerId;
+    int leaseSeconds;
+    int maxAttempts;
+    string shardCursor;     // shard this worker found work in last
+
+    string jobsDir() const { return queueDir + "/jobs"; }
+    string leasesDir() const { return queueDir + "/leases"; }
+    string doneDir() const { return queueDir + "/done"; }
+
+    static string shardOf(const string& jobId) { return jobId.substr(0, 2); }
+
+    string jobFile(const string& jobId) const {
+        return jobsDir() + "/" + shardOf(jobId) + "/" + jobId + ".job";
+    }
+    string doneFile(const string& jobId) const {
+        return doneDir() + "/" + shardOf(jobId) + "/" + jobId + ".done";
+    }
+    string leaseFile(const string& jobId, int generation) const {
+        return leasesDir() + "/" + shardOf(jobId) + "/" + jobId + "." + to_string(generation);
+    }
+
+    static bool endsWith(const string& str, const string& suffix) {
+        return str.size() >= suffix.size() &&
+               str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    static map<string, string> readKeyValues(const string& path) {
+        map<string, string> values;
+        ifstream file(path);
+        string line;
+        while (getline(file, line)) {
+            size_t separator = line.find('=');
+            if (separator != string::npos) {
+                values[line.substr(0, separator)] = line.substr(separator + 1);
+            }
+        }
+        return values;
+    }
+
+    // Fails if the file already exists, this is what makes a claim atomic
+    static bool createExclusive(const string& path, const string& content) {
+        FILE* file = fopen(path.c_str(), "wx");
+        if (!file) return false;
+        fwrite(content.data(), 1, content.size(), file);
+        fclose(file);
+        return true;
+    }
+
+    // Readers see either the old or the new content, never a partial file
+    void writeAtomically(const string& path, const string& content) const {
+        size_t slash = path.find_last_of('/');
+        string tempPath = path.substr(0, slash + 1) + "." + path.substr(slash + 1) + "." + workerId + ".tmp";
+        ofstream file(tempPath, ios::trunc);
+        if (!file.is_open()) {
+            throw FileSystemException("Failed to write: " + tempPath);
+        }
+        file << content;
+        file.close();
+        if (!FileSystemManager::replaceFile(tempPath, path)) {
+            remove(tempPath.c_str());
+            throw FileSystemException("Failed to replace: " + path);
+        }
+    }
+
+    // 'state' is "running" while a worker holds the job, "backoff" while a
+    // failed job waits for its next attempt
+    string leaseContent(time_t expires, const string& state = "running") const {
+        time_t now = time(nullptr);
+        return "worker=" + workerId + "\n"
+               "state=" + state + "\n"
+               "heartbeat=" + to_string(static_cast<long long>(now)) + "\n"
+               "expires=" + to_string(static_cast<long long>(expires)) + "\n";
+    }
+
+    // A lease that was just created may still be empty; it only counts as
+    // expired once its file is older than a whole lease period
+    bool isLeaseExpired(const string& jobId, int generation) const {
+        return isLeaseExpired(jobId, generation, readKeyValues(leaseFile(jobId, generation)));
+    }
+
+    bool isLeaseExpired(const string& jobId, int generation, const map<string, string>& lease) const {
+        string path = leaseFile(jobId, generation);
+        time_t now = time(nullptr);
+
+        auto expires = lease.find("expires");
+        if (expires != lease.end()) {
+            return atoll(expires->second.c_str()) <= now;
+        }
+
+        STAT_STRUCT st;
+        if (STAT(path.c_str(), &st) != 0) return false;
+        return now - st.st_mtime > leaseSeconds;
+    }
+
+    static vector<string> listIfExists(const string& dir) {
+        return FileSystemManager::isDirectory(dir) ? FileSystemManager::listDirectory(dir) : vector<string>();
+    }
+
+    // Shard folders below a queue subdirectory
+    static vector<string> listShards(const string& dir) {
+        vector<string> shards;
+        for (const string& name : listIfExists(dir)) {
+            if (name[0] != '.') shards.push_back(name);
+        }
+        sort(shards.begin(), shards.end());
+        return shards;
+    }
+
+    // Names in a folder ending in 'suffix', with the suffix removed
+    static vector<string> listIds(const string& dir, const string& suffix) {
+        vector<string> ids;
+        for (const string& name : listIfExists(dir)) {
+            if (name[0] != '.' && endsWith(name, suffix)) {
+                ids.push_back(name.substr(0, name.size() - suffix.size()));
+            }
+        }
+        return ids;
+    }
+
+    // Lease generations per job in one shard
+    map<string, vector<int>> shardLeases(const string& shard) const {
+        map<string, vector<int>> generations;
+        for (const string& name : listIfExists(leasesDir() + "/" + shard)) {
+            size_t dot = name.find_last_of('.');
+            if (name[0] == '.' || dot == string::npos || dot == 0) continue;
+            generations[name.substr(0, dot)].push_back(atoi(name.c_str() + dot + 1));
+        }
+        return generations;
+    }
+
+    int currentGeneration(const string& jobId) const {
+        auto leases = shardLeases(shardOf(jobId));
+        auto it = leases.find(jobId);
+        return it == leases.end() ? 0 : *max_element(it->second.begin(), it->second.end());
+    }
+
+    bool readJob(const string& jobId, QueueJob& job) const {
+        map<string, string> values = readKeyValues(jobFile(jobId));
+        if (values["url"].empty()) return false;
+
+        job.id = jobId;
+        job.url = values["url"];
+        job.quality = atoi(values["quality"].c_str());
+        job.format = values["format"].empty() ? "mp4" : values["format"];
+        job.audioOnly = values["audio"] == "1";
+        job.outputDir = values["output"].empty() ? "downloads" : values["output"];
+        job.layout = values["layout"];
+        return true;
+    }
+
+    // Drop the job description and all its leases once the result is recorded,
+    // so workers never scan finished jobs again
+    void removeFinishedJob(const string& jobId) {
+        remove(jobFile(jobId).c_str());
+        auto leases = shardLeases(shardOf(jobId));
+        auto it = leases.find(jobId);
+        if (it == leases.end()) return;
+        for (int generation : it->second) {
+            remove(leaseFile(jobId, generation).c_str());
+        }
+    }
+
+    void recordResult(const string& jobId, int generation, const string& status) {
+        map<string, string> job = readKeyValues(jobFile(jobId));
+        FileSystemManager::createDirectories(doneDir() + "/" + shardOf(jobId));
+
+        // A second completion of the same job (e.g. after a reclaim) is ignored
+        createExclusive(doneFile(jobId),
+                        "status=" + status + "\n"
+                        "url=" + job["url"] + "\n"
+                        "worker=" + workerId + "\n"
+                        "attempt=" + to_string(generation) + "\n"
+                        "finished=" + to_string(static_cast<long long>(time(nullptr))) + "\n");
+        removeFinishedJob(jobId);
+    }
+
+    // Try to take over one job given its current lease generation
+    bool tryClaim(const string& jobId, int generation, QueueJob& job, JobLease& lease) {
+        if (isFinished(jobId)) {
+            removeFinishedJob(jobId);   // Left over from a worker that stopped halfway
+            return false;
+        }
+        if (generation > 0 && !isLeaseExpired(jobId, generation)) return false;
+
+        if (generation >= maxAttempts) {
+            recordResult(jobId, generation, "failed");
+            return false;
+        }
+
+        FileSystemManager::createDirectories(leasesDir() + "/" + shardOf(jobId));
+        time_t expires = time(nullptr) + leaseSeconds;
+        if (!createExclusive(leaseFile(jobId, generation + 1), leaseContent(expires))) {
+            return false; // Another worker was faster
+        }
+
+        lease.jobId = jobId;
+        lease.generation = generation + 1;
+        if (readJob(jobId, job)) return true;
+
+        recordResult(jobId, lease.generation, "failed");
+        return false;
+    }
+
+public:
+    SharedWorkQueue(const string& dir, const string& worker = defaultWorkerId(),
+                    int leaseTime = 60, int attempts = 3)
+        : queueDir(dir), workerId(worker), leaseSeconds(leaseTime), maxAttempts(attempts) {
+        FileSystemManager::createDirectories(jobsDir());
+        FileSystemManager::createDirectories(leasesDir());
+        FileSystemManager::createDirectories(doneDir());
+
+        // Start at a worker specific shard so workers don't all race for the same jobs
+        ostringstream shard;
+        shard << hex << setw(2) << setfill('0') << (hash<string>()(workerId) % 256);
+        shardCursor = shard.str();
+    }
+
+    static string defaultWorkerId() {
+        return processTag();
+    }
+
+    // Same job description always maps to the same ID, so enqueueing twice is harmless
+    static string makeJobId(const QueueJob& job) {
+        string key = job.url + "|" + to_string(job.quality) + "|" + job.format + "|" +
+                     (job.audioOnly ? "1" : "0") + "|" + job.outputDir + "|" + job.layout;
+        unsigned long long hash = 14695981039346656037ULL;
+        for (unsigned char c : key) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        ostringstream id;
+        id << hex << setw(16) << setfill('0') << hash;
+        return id.str();
+    }
+
+    const string& getWorkerId() const { return workerId; }
+    int getLeaseSeconds() const { return leaseSeconds; }
+
+    // A job that failed before is queued again with a fresh set of attempts,
+    // one that succeeded is left alone
+    string enqueue(QueueJob job) {
+        job.id = makeJobId(job);
+        if (isFinished(job.id)) {
+            if (readKeyValues(doneFile(job.id))["status"] != "failed") return job.id;
+            removeFinishedJob(job.id);
+            remove(doneFile(job.id).c_str());
+        }
+        if (!FileSystemManager::fileExists(jobFile(job.id))) {
+            FileSystemManager::createDirectories(jobsDir() + "/" + shardOf(job.id));
+            writeAtomically(jobFile(job.id),
+                            "url=" + job.url + "\n"
+                            "quality=" + to_string(job.quality) + "\n"
+                            "format=" + job.format + "\n"
+                            "audio=" + (job.audioOnly ? "1" : "0") + "\n"
+                            "output=" + job.outputDir + "\n"
+                            "layout=" + job.layout + "\n");
+        }
+        return job.id;
+    }
+
+    // Claim one job that is neither finished nor held by a live lease. Shards
+    // are visited one at a time, starting where this worker last found work.
+    // Jobs in 'tryLast' (e.g. ones this worker just failed) are only taken
+    // when nothing else is available, so another worker gets the retry.
+    bool claim(QueueJob& job, JobLease& lease, const set<string>& tryLast = set<string>()) {
+        vector<string> shards = listShards(jobsDir());
+        rotate(shards.begin(), lower_bound(shards.begin(), shards.end(), shardCursor), shards.end());
+
+        for (const string& shard : shards) {
+            vector<string> jobs = listIds(jobsDir() + "/" + shard, ".job");
+            if (jobs.empty()) continue;
+
+            map<string, vector<int>> leases = shardLeases(shard);
+            for (const string& jobId : jobs) {
+                if (tryLast.count(jobId)) continue;
+                auto it = leases.find(jobId);
+                int generation = it == leases.end() ? 0 : *max_element(it->second.begin(), it->second.end());
+                if (tryClaim(jobId, generation, job, lease)) {
+                    shardCursor = shard;
+                    return true;
+                }
+            }
+        }
+
+        for (const string& jobId : tryLast) {
+            if (FileSystemManager::fileExists(jobFile(jobId)) &&
+                tryClaim(jobId, currentGeneration(jobId), job, lease)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool isFinished(const string& jobId) const {
+        return FileSystemManager::fileExists(doneFile(jobId));
+    }
+
+    // Extend the lease. Returns false once another worker has reclaimed (or
+    // finished) the job, in which case this worker no longer owns it.
+    bool heartbeat(const JobLease& lease) {
+        if (FileSystemManager::fileExists(leaseFile(lease.jobId, lease.generation + 1)) ||
+            isFinished(lease.jobId)) {
+            return false;
+        }
+        writeAtomically(leaseFile(lease.jobId, lease.generation), leaseContent(time(nullptr) + leaseSeconds));
+        return true;
+    }
+
+    // Finish a claimed job. Failures are handed back to the queue until the
+    // attempts are used up; the lease stays alive for a growing backoff so
+    // transient problems (network, rate limits) have time to clear.
+    // 'retry' false marks a failure as final right away. Returns false and
+    // records nothing if another worker has reclaimed the job meanwhile, the
+    // result belongs to the new owner then.
+    bool complete(const JobLease& lease, bool success, bool retry = true) {
+        if (FileSystemManager::fileExists(leaseFile(lease.jobId, lease.generation + 1))) {
+            return false;
+        }
+        if (success || !retry || lease.generation >= maxAttempts) {
+            recordResult(lease.jobId, lease.generation, success ? "success" : "failed");
+        } else {
+            time_t retryAt = time(nullptr) + static_cast<time_t>(leaseSeconds) * lease.generation;
+            writeAtomically(leaseFile(lease.jobId, lease.generation), leaseContent(retryAt, "backoff"));
+        }
+        return true;
+    }
+
+    // Finished jobs leave jobs/, so this only looks at unfinished ones
+    bool isDrained() const {
+        for (const string& shard : listShards(jobsDir())) {
+            if (!listIds(jobsDir() + "/" + shard, ".job").empty()) return false;
+        }
+        return true;
     }
 
-    static void clearScreen() {
-        #ifdef _WIN32
-            system("cls");
-        #else
-            system("clear");
-        #endif
-    }
+    QueueStatus status() const {
+        QueueStatus result;
+        for (const string& shard : listShards(doneDir())) {
+            for (const string& jobId : listIds(doneDir() + "/" + shard, ".done")) {
+                result.total++;
+                if (readKeyValues(doneFile(jobId))["status"] == "success") {
+                    result.completed++;
+                } else {
+                    result.failed++;
+                }
+            }
+        }
 
-    static string detectDownloaderPath(bool verboseMode = false) {
-        vector<string> possiblePaths = {
-            #ifdef _WIN32
-                "libs\\yt-dlp.exe",
-                "yt-dlp.exe",
-                "bin\\yt-dlp.exe"
-            #else
-                "./libs/yt-dlp",
-                "./yt-dlp",
-                "/usr/local/bin/yt-dlp",
-                "/usr/bin/yt-dlp",
-                "./bin/yt-dlp"
-            #endif
-        };
+        for (const string& shard : listShards(jobsDir())) {
+            map<string, vector<int>> leases = shardLeases(shard);
+            for (const string& jobId : listIds(jobsDir() + "/" + shard, ".job")) {
+                if (isFinished(jobId)) continue;   // Counted above, cleanup still pending
+                result.total++;
 
-        for (const string& path : possiblePaths) {
-            if (fileExists(path)) {
-                if (!isExecutable(path)) {
-                    makeExecutable(path);
+                auto it = leases.find(jobId);
+                if (it == leases.end()) {
+                    result.waiting++;
+                    continue;
                 }
-                if (verboseMode) {
-                    cout << "✅ Found yt-dlp at: " << path << endl;
+                int generation = *max_element(it->second.begin(), it->second.end());
+                map<string, string> lease = readKeyValues(leaseFile(jobId, generation));
+                if (!isLeaseExpired(jobId, generation, lease) && lease["state"] != "backoff") {
+                    result.running++;
+                } else {
+                    result.waiting++;
                 }
-                return path;
             }
         }
-
-        // Instead of exit, throw exception
-        string errorMsg = "❌ Error: yt-dlp not found anywhere!\n";
-        errorMsg += "Please install yt-dlp or place it in one of these locations:\n";
-        for (const string& path : possiblePaths) {
-            errorMsg += "  - " + path + "\n";
-        }
-        
-        throw FileSystemException(errorMsg);
+        return result;
     }
 };
 
@@ -288,6 +1984,15 @@ public:
         return false;
     }
 
+    // Video ID of a single-video URL, empty for playlists and channels
+    string extractVideoId(const string& url) {
+        smatch match;
+        if (regex_search(url, match, regex(R"((?:[?&]v=|youtu\.be/)([a-zA-Z0-9_-]{11}))"))) {
+            return match[1];
+        }
+        return "";
+    }
+
     string trimString(const string& str) {
         size_t start = str.find_first_not_of(" \t\n\r");
         if (start == string::npos) return "";
@@ -421,13 +2126,200 @@ private:
     DownloadLogger* logger;
     InputValidator validator;
     SecureCommandBuilder commandBuilder;
+    OutputLayout outputLayout;
+    FormatSelector formatSelector;
+    FormatPolicy formatPolicy;
+    bool interactive = true;
+    bool lastFailureRetryable = true;
+    const atomic<bool>* cancelFlag = nullptr;
+    
+    bool isCancelled() const {
+        return cancelFlag && *cancelFlag;
+    }
+    
+    int runCommand(const string& command) {
+        return cancelFlag ? ProcessRunner::run(command, *cancelFlag) : system(command.c_str());
+    }
+    
+    // Refuse a download that would push a folder of a sharded library over
+    // the limit. Flat libraries have no limit. Only folders on the target
+    // shard path that gain a new entry are read, so the check stays cheap.
+    void checkFolderLimit(const string& outputDir, const FormatSelection& selection) {
+        if (outputLayout.isFlat()) return;
+
+        const string& id = selection.videoId;
+        string shard = id.empty() ? "" : outputLayout.shardPath(OutputLayout::folderName(selection.uploader),
+                                                                selection.uploadDate, id);
+
+        // Folders above the deepest existing one keep their entry count
+        string existing;
+        string remaining = shard;
+        while (!remaining.empty()) {
+            size_t slash = remaining.find('/');
+            string name = remaining.substr(0, slash);
+            string candidate = existing.empty() ? name : existing + "/" + name;
+            if (!FileSystemManager::isDirectory(outputDir + "/" + candidate)) break;
+            existing = candidate;
+            remaining = slash == string::npos ? "" : remaining.substr(slash + 1);
+        }
+
+        string baseDir = existing.empty() ? outputDir : outputDir + "/" + existing;
+        DirectoryBudget budget(baseDir);
+        if (!id.empty()) {
+            // Placeholders for the media file and its sidecars
+            budget.add(remaining, {id + ".media", id + ".info.json", id + ".thumbnail", id + ".subtitles"});
+        } else {
+            // Without metadata the target is unknown, but the top folder gains at most one entry
+            budget.add("", {""});
+        }
+
+        string folder;
+        size_t entryCount = 0;
+        if (budget.findOverflow(outputLayout.getMaxEntriesPerDirectory(), folder, entryCount)) {
+            throw DownloadException("❌ Folder '" + (folder.empty() ? baseDir : baseDir + "/" + folder) +
+                                    "' would hold " + to_string(entryCount) + " entries, over the limit of " +
+                                    to_string(outputLayout.getMaxEntriesPerDirectory()) + ".\n"
+                                    "Choose a layout with more levels or a longer video ID prefix in Settings,\n"
+                                    "then migrate the library.", false);
+        }
+    }
+    
+    // Download one URL, throws DownloadException on failure
+    void downloadSingle(const string& url, int quality, const string& format,
+                        const string& outputDir, bool audioOnly, bool verboseMode) {
+        if (isCancelled()) {
+            throw DownloadException("⛔ Download cancelled");
+        }
+        
+        FormatSelection selection = selectFormats(url, quality, format, audioOnly, verboseMode);
+        checkFolderLimit(outputDir, selection);
+
+        string command = commandBuilder.buildDownloadCommand(
+            downloaderPath, url, outputDir, outputLayout.outputTemplate(), quality, format, audioOnly,
+            selection.formatSpec, selection.infoJsonPath
+        );
+
+        if (verboseMode) {
+            cout << "🔧 Command: " << command << endl;
+        }
+
+        cout << "🚀 Starting download..." << endl;
+
+        int result = runCommand(command);
+        bool success = (result == 0);
+
+        // Cached metadata may hold stream URLs that have expired meanwhile;
+        // select again from fresh metadata once
+        if (!success && selection.fromCache && !isCancelled()) {
+            cout << "🔁 Retrying with fresh metadata..." << endl;
+            formatSelector.invalidate(validator.extractVideoId(url));
+            selection = selectFormats(url, quality, format, audioOnly, verboseMode);
+            command = commandBuilder.buildDownloadCommand(
+                downloaderPath, url, outputDir, outputLayout.outputTemplate(), quality, format, audioOnly,
+                selection.formatSpec, selection.infoJsonPath
+            );
+            success = (runCommand(command) == 0);
+        }
+
+        if (isCancelled()) {
+            throw DownloadException("⛔ Download cancelled");
+        }
+
+        if (!success) {
+            // More detailed failure reasons
+            string errorMsg = "❌ Download failed! Possible reasons:\n";
+            errorMsg += "  1. Internet connection problem\n";
+            errorMsg += "  2. Invalid or unavailable URL\n";
+            errorMsg += "  3. Video not available in your region\n";
+            errorMsg += "  4. Requested quality not available\n";
+            errorMsg += "  5. Disk space full\n";
+            
+            throw DownloadException(errorMsg);
+        }
+
+        if (!selection.videoId.empty()) {
+            formatSelector.invalidate(selection.videoId);
+        }
+
+        cout << "✅ Download successful!" << endl;
+        cout << "📁 Files saved to: " << outputDir << endl;
+    }
+    
+    // Exact format IDs for single videos; playlists and channels, or a
+    // failed metadata lookup, keep yt-dlp's own fallback chain
+    FormatSelection selectFormats(const string& url, int quality, const string& format,
+                                  bool audioOnly, bool verboseMode) {
+        string videoId = validator.extractVideoId(url);
+        if (videoId.empty()) return FormatSelection();
+        
+        FormatPolicy policy = formatPolicy;
+        policy.maxHeight = (quality == 0) ? 2160 : quality;
+        policy.container = format;
+        policy.audioOnly = audioOnly;
+        
+        cout << "🔍 Reading available formats..." << endl;
+        FormatSelection selection = formatSelector.select(videoId, url, policy);
+        if (selection.isValid()) {
+            cout << "🎯 Selected formats: " << selection.formatSpec << " (" << selection.description;
+            if (selection.expectedBytes > 0) {
+                cout << ", ~" << formatBytes(selection.expectedBytes);
+            }
+            cout << ")" << endl;
+        } else if (verboseMode) {
+            cout << "⚠️  No format table available, letting yt-dlp choose" << endl;
+        }
+        return selection;
+    }
     
 public:
     VideoDownloader(const string& path, DownloadLogger* log) 
-        : downloaderPath(path), logger(log) {}
+        : downloaderPath(path), logger(log), formatSelector(path) {}
+    
+    void setOutputLayout(const OutputLayout& layout) {
+        outputLayout = layout;
+    }
+    
+    void setFormatPolicy(const FormatPolicy& policy) {
+        formatPolicy = policy;
+    }
+    
+    // Queue workers run unattended and must never wait for a key press
+    void setInteractive(bool enabled) {
+        interactive = enabled;
+    }
+    
+    // While set, a running download is stopped as soon as the flag turns true
+    void setCancelFlag(const atomic<bool>* flag) {
+        cancelFlag = flag;
+    }
+    
+    // Video IDs of a playlist or channel, empty if they could not be listed
+    vector<string> listVideoIds(const string& url) {
+        vector<string> videoIds;
+        string command = commandBuilder.buildPlaylistCommand(downloaderPath, url);
+        FILE* pipe = POPEN(command.c_str(), "r");
+        if (!pipe) return videoIds;
+
+        char line[256];
+        regex idPattern(R"([a-zA-Z0-9_-]{11})");
+        while (fgets(line, sizeof(line), pipe)) {
+            string videoId = validator.trimString(line);
+            if (regex_match(videoId, idPattern)) {
+                videoIds.push_back(videoId);
+            }
+        }
+        PCLOSE(pipe);
+        return videoIds;
+    }
+    
+    // Whether the last failed download() may succeed when tried again
+    bool canRetryLastFailure() const {
+        return lastFailureRetryable;
+    }
     
     bool download(const string& url, int quality, const string& format, 
                  const string& outputDir, bool audioOnly = false, bool verboseMode = false) {
+        lastFailureRetryable = true;
         
         try {
             if (!validator.isValidURL(url)) {
@@ -436,54 +2328,63 @@ public:
                                       "  - Short link: youtu.be/...\n"
                                       "  - Playlist: youtube.com/playlist?list=...\n"
                                       "  - Channel: youtube.com/channel/...\n"
-                                      "  - Username: youtube.com/@username");
+                                      "  - Username: youtube.com/@username", false);
             }
 
-            string command = commandBuilder.buildDownloadCommand(
-                downloaderPath, url, outputDir, quality, format, audioOnly
-            );
-
-            if (verboseMode) {
-                cout << "🔧 Command: " << command << endl;
+            vector<string> videoIds;
+            if (validator.extractVideoId(url).empty()) {
+                cout << "📋 Listing videos..." << endl;
+                videoIds = listVideoIds(url);
             }
 
-            cout << "🚀 Starting download..." << endl;
+            if (videoIds.empty()) {
+                downloadSingle(url, quality, format, outputDir, audioOnly, verboseMode);
+                if (logger) {
+                    logger->logDownload(url, quality, format, true);
+                }
+                return true;
+            }
 
-            int result = system(command.c_str());
-            bool success = (result == 0);
+            // Playlists and channels go video by video, so every video gets exact
+            // formats and is checked against the folder limit
+            size_t failed = 0;
+            for (size_t i = 0; i < videoIds.size(); ++i) {
+                string videoUrl = "https://www.youtube.com/watch?v=" + videoIds[i];
+                cout << "\n📼 Video " << i + 1 << "/" << videoIds.size() << ": " << videoUrl << endl;
 
-            if (success) {
-                cout << "✅ Download successful!" << endl;
-                cout << "📁 Files saved to: " << outputDir << endl;
-            } else {
-                // More detailed failure reasons
-                string errorMsg = "❌ Download failed! Possible reasons:\n";
-                errorMsg += "  1. Internet connection problem\n";
-                errorMsg += "  2. Invalid or unavailable URL\n";
-                errorMsg += "  3. Video not available in your region\n";
-                errorMsg += "  4. Requested quality not available\n";
-                errorMsg += "  5. Disk space full\n";
-                
-                throw DownloadException(errorMsg);
-            }
-
-            // Log the result
-            if (logger) {
-                logger->logDownload(url, quality, format, success);
+                bool success = true;
+                try {
+                    downloadSingle(videoUrl, quality, format, outputDir, audioOnly, verboseMode);
+                } catch (const DownloadException& e) {
+                    cerr << e.what() << endl;
+                    success = false;
+                    failed++;
+                }
+                if (logger) {
+                    logger->logDownload(videoUrl, quality, format, success);
+                }
+                if (isCancelled()) {
+                    throw DownloadException("⛔ Download cancelled");
+                }
             }
 
-            return success;
+            if (failed > 0) {
+                throw DownloadException("❌ " + to_string(failed) + " of " + to_string(videoIds.size()) +
+                                        " videos failed");
+            }
+            return true;
             
         } catch (const DownloadException& e) {
             cerr << e.what() << endl;
-            waitForKeyPress();
+            lastFailureRetryable = e.isRetryable();
+            if (interactive) waitForKeyPress();
             if (logger) {
                 logger->logDownload(url, quality, format, false);
             }
             return false;
         } catch (const exception& e) {
             cerr << "❌ Unexpected error: " << e.what() << endl;
-            waitForKeyPress();
+            if (interactive) waitForKeyPress();
             if (logger) {
                 logger->logDownload(url, quality, format, false);
             }
@@ -492,6 +2393,132 @@ public:
     }
 };
 
+// ===============================================
+// Queue Worker Class
+// ===============================================
+// Runs downloads from a SharedWorkQueue without any user interaction,
+// keeping the lease of the current job alive from a background thread.
+class QueueWorker {
+private:
+    SharedWorkQueue queue;
+    DownloadLogger logger;
+    VideoDownloader* downloader = nullptr;
+    bool verboseMode;
+
+    bool runJob(const QueueJob& job, const JobLease& lease) {
+        cout << "▶️  [" << queue.getWorkerId() << "] Job " << job.id << " (attempt " << lease.generation
+             << "): " << job.url << endl;
+
+        // After a reclaim the previous owner may have finished the job in the meantime
+        if (lease.generation > 1 && queue.isFinished(job.id)) {
+            cout << "⏭️  Job " << job.id << " was already finished by another worker" << endl;
+            return true;
+        }
+
+        mutex heartbeatMutex;
+        condition_variable heartbeatSignal;
+        bool finished = false;
+        atomic<bool> leaseLost(false);
+
+        thread heartbeatThread([&]() {
+            unique_lock<mutex> lock(heartbeatMutex);
+            auto interval = chrono::seconds(max(1, queue.getLeaseSeconds() / 3));
+            while (!heartbeatSignal.wait_for(lock, interval, [&]() { return finished; })) {
+                try {
+                    if (!queue.heartbeat(lease)) {
+                        cerr << "⚠️  Lease of job " << job.id << " was taken over, stopping the download" << endl;
+                        leaseLost = true;
+                        return;
+                    }
+                } catch (const exception& e) {
+                    cerr << "⚠️  Heartbeat failed: " << e.what() << endl;
+                }
+            }
+        });
+
+        bool success = false;
+        bool retry = true;
+        try {
+            FileSystemManager::createDirectories(job.outputDir);
+            // The folder limit always comes from the library itself
+            OutputLayout layout = OutputLayout::load(job.outputDir);
+            if (!job.layout.empty()) {
+                size_t maxEntries = layout.getMaxEntriesPerDirectory();
+                layout = OutputLayout::fromSpec(job.layout);
+                layout.setMaxEntriesPerDirectory(maxEntries);
+            }
+            downloader->setOutputLayout(layout);
+            downloader->setCancelFlag(&leaseLost);
+            success = downloader->download(job.url, job.quality, job.format, job.outputDir,
+                                           job.audioOnly, verboseMode);
+            retry = downloader->canRetryLastFailure();
+        } catch (const exception& e) {
+            cerr << "❌ Job " << job.id << " failed: " << e.what() << endl;
+        }
+        downloader->setCancelFlag(nullptr);
+
+        {
+            lock_guard<mutex> lock(heartbeatMutex);
+            finished = true;
+        }
+        heartbeatSignal.notify_one();
+        heartbeatThread.join();
+
+        // The job belongs to its new owner now, which records the result
+        if (leaseLost) return false;
+        if (!queue.complete(lease, success, retry)) {
+            cerr << "⚠️  Job " << job.id << " was taken over by another worker, result dropped" << endl;
+            return false;
+        }
+        return success;
+    }
+
+public:
+    QueueWorker(const string& queueDir, int leaseSeconds, bool verbose = false)
+        : queue(queueDir, SharedWorkQueue::defaultWorkerId(), leaseSeconds),
+          logger(queueDir + "/" + SharedWorkQueue::defaultWorkerId() + ".log"),
+          verboseMode(verbose) {}
+
+    ~QueueWorker() {
+        delete downloader;
+    }
+
+    // Work until every job in the queue is finished
+    int run() {
+        string downloaderPath = FileSystemManager::detectDownloaderPath(verboseMode);
+        downloader = new VideoDownloader(downloaderPath, &logger);
+        downloader->setInteractive(false);
+
+        cout << "👷 Worker " << queue.getWorkerId() << " started" << endl;
+
+        size_t succeeded = 0, failed = 0;
+        set<string> failedHere;
+        int pollMs = 1000 * max(1, min(5, queue.getLeaseSeconds() / 2));
+
+        while (true) {
+            QueueJob job;
+            JobLease lease;
+            if (queue.claim(job, lease, failedHere)) {
+                if (runJob(job, lease)) {
+                    succeeded++;
+                } else {
+                    failed++;
+                    failedHere.insert(job.id);
+                }
+            } else if (queue.isDrained()) {
+                break;
+            } else {
+                // Remaining jobs are held by other workers, wait in case a lease expires
+                SLEEP(pollMs);
+            }
+        }
+
+        cout << "🏁 Worker " << queue.getWorkerId() << " finished: " << succeeded << " succeeded, "
+             << failed << " failed" << endl;
+        return 0;
+    }
+};
+
 // ===============================================
 // Main Application Class
 // ===============================================
@@ -501,6 +2528,8 @@ private:
     string downloadDir = "downloads";
     string logFile = "logs/download_log.txt";
     bool verboseMode = false;
+    OutputLayout outputLayout;
+    FormatPolicy formatPolicy;
     
     DownloadLogger* logger;
     VideoDownloader* downloader;
@@ -519,6 +2548,7 @@ public:
             // Create logger and downloader
             logger = new DownloadLogger(logFile);
             downloader = new VideoDownloader(downloaderPath, logger);
+            loadOutputLayout();
             
         } catch (const exception& e) {
             cerr << e.what() << endl;
@@ -532,17 +2562,37 @@ public:
         delete downloader;
     }
     
+    void loadOutputLayout() {
+        outputLayout = OutputLayout::load(downloadDir);
+        downloader->setOutputLayout(outputLayout);
+    }
+    
+    void saveOutputLayout() {
+        try {
+            outputLayout.save(downloadDir);
+        } catch (const exception& e) {
+            cerr << "⚠️  " << e.what() << endl;
+        }
+        downloader->setOutputLayout(outputLayout);
+    }
+    
     void showSettings() {
         cout << "⚙️  Settings" << endl;
         cout << "──────────────────────────────────────────" << endl;
         cout << "Current download directory: " << downloadDir << endl;
         cout << "Verbose mode: " << (verboseMode ? "Enabled" : "Disabled") << endl;
         cout << "Downloader path: " << downloaderPath << endl;
+        cout << "Output layout: " << outputLayout.toSpec()
+             << " (max " << outputLayout.getMaxEntriesPerDirectory() << " files per folder)" << endl;
+        cout << "Preferred video codecs: " << describeFormatPolicy() << endl;
         cout << endl;
         
         cout << "1. Change download directory" << endl;
         cout << "2. Toggle verbose mode" << endl;
         cout << "3. Test downloader" << endl;
+        cout << "4. Change output layout" << endl;
+        cout << "5. Migrate flat library to current layout" << endl;
+        cout << "6. Change format selection policy" << endl;
         cout << "0. Back to main menu" << endl;
         cout << "Choose option: ";
         
@@ -559,6 +2609,7 @@ public:
                     downloadDir = newDir;
                     try {
                         FileSystemManager::createDirectory(downloadDir);
+                        loadOutputLayout();
                         cout << "✅ Download directory changed to: " << downloadDir << endl;
                     } catch (const exception& e) {
                         cerr << "❌ Failed to create directory: " << e.what() << endl;
@@ -577,6 +2628,128 @@ public:
                 system(testCmd.c_str());
                 break;
             }
+            case 4:
+                changeOutputLayout();
+                break;
+            case 5:
+                migrateLibrary();
+                break;
+            case 6:
+                changeFormatPolicy();
+                break;
+        }
+    }
+    
+    string describeFormatPolicy() {
+        string codecs;
+        for (const string& codec : formatPolicy.videoCodecs) {
+            codecs += (codecs.empty() ? "" : ",") + codec;
+        }
+        string result = codecs.empty() ? "container default" : codecs;
+        if (formatPolicy.maxVideoBitrate > 0) {
+            result += " | max " + to_string(static_cast<int>(formatPolicy.maxVideoBitrate)) + " kbit/s";
+        }
+        return result;
+    }
+    
+    void changeFormatPolicy() {
+        cout << "Preferred video codecs, best first (e.g. avc1,vp9,av01; 'default' for container default): ";
+        string codecs;
+        getline(cin, codecs);
+        if (!codecs.empty()) {
+            formatPolicy.videoCodecs.clear();
+            if (codecs != "default") {
+                stringstream stream(codecs);
+                string codec;
+                while (getline(stream, codec, ',')) {
+                    codec = InputValidator().trimString(codec);
+                    if (!codec.empty()) formatPolicy.videoCodecs.push_back(codec);
+                }
+            }
+        }
+        
+        cout << "Maximum video bitrate in kbit/s (0 for no limit, Enter to keep): ";
+        string bitrate;
+        getline(cin, bitrate);
+        if (!bitrate.empty()) {
+            try {
+                formatPolicy.maxVideoBitrate = max(0.0, stod(bitrate));
+            } catch (const exception&) {
+                cerr << "❌ Invalid bitrate, keeping the previous value" << endl;
+            }
+        }
+        
+        downloader->setFormatPolicy(formatPolicy);
+        cout << "✅ Format policy: " << describeFormatPolicy() << endl;
+    }
+    
+    void changeOutputLayout() {
+        cout << "Layout levels: uploader, year, month, date (year/month), id1-id4 (video ID prefix)" << endl;
+        cout << "Example: uploader/date/id2   or   flat" << endl;
+        cout << "Enter new layout: ";
+        string spec;
+        getline(cin, spec);
+        if (spec.empty()) return;
+        
+        try {
+            OutputLayout layout = OutputLayout::fromSpec(spec);
+            layout.setMaxEntriesPerDirectory(outputLayout.getMaxEntriesPerDirectory());
+            
+            cout << "Max files per folder (Enter to keep " << layout.getMaxEntriesPerDirectory() << "): ";
+            string maxEntries;
+            getline(cin, maxEntries);
+            if (!maxEntries.empty()) {
+                layout.setMaxEntriesPerDirectory(stoul(maxEntries));
+            }
+            
+            if (layout.getMaxEntriesPerDirectory() == 0) {
+                throw LayoutException("The folder limit must be at least 1");
+            }
+            
+            outputLayout = layout;
+            saveOutputLayout();
+            cout << "✅ Output layout changed to: " << outputLayout.toSpec() << endl;
+        } catch (const exception& e) {
+            cerr << "❌ Invalid layout: " << e.what() << endl;
+            waitForKeyPress();
+        }
+    }
+    
+    void migrateLibrary() {
+        if (outputLayout.isFlat()) {
+            cout << "❌ Choose a sharded output layout first (option 4)." << endl;
+            return;
+        }
+        
+        cout << "🚚 Moving files in " << downloadDir << " to layout " << outputLayout.toSpec() << "..." << endl;
+        
+        try {
+            LibraryMigrator migrator;
+            MigrationReport report = migrator.migrate(downloadDir, outputLayout);
+            
+            cout << "✅ Moved " << report.filesMoved << " files of " << report.videosMoved << " videos";
+            if (report.filesSkipped > 0) {
+                cout << " (" << report.filesSkipped << " skipped)";
+            }
+            cout << endl;
+            
+            if (verboseMode) {
+                for (const string& error : report.errors) {
+                    cerr << "  - " << error << endl;
+                }
+            } else if (!report.errors.empty()) {
+                cout << "⚠️  " << report.errors.size() << " problems, enable verbose mode for details" << endl;
+            }
+            
+            if (report.layout.toSpec() != outputLayout.toSpec()) {
+                outputLayout = report.layout;
+                saveOutputLayout();
+                cout << "📐 Layout changed to " << outputLayout.toSpec()
+                     << " to stay within " << outputLayout.getMaxEntriesPerDirectory() << " entries per folder" << endl;
+            }
+        } catch (const exception& e) {
+            cerr << "❌ Migration failed: " << e.what() << endl;
+            waitForKeyPress();
         }
     }
     
@@ -692,10 +2865,148 @@ public:
     }
 };
 
+// ===============================================
+// Command Line Interface
+// ===============================================
+void printUsage(const string& program) {
+    cout << "Usage:" << endl;
+    cout << "  " << program << "                                   Interactive mode" << endl;
+    cout << "  " << program << " --enqueue <queue-dir> <url> [options]" << endl;
+    cout << "      --quality <p>      Maximum height, 0 for best (default 0)" << endl;
+    cout << "      --format <ext>     mp4, webm, mkv or avi (default mp4)" << endl;
+    cout << "      --audio            Audio only (mp3)" << endl;
+    cout << "      --output <dir>     Download directory (default downloads)" << endl;
+    cout << "      --layout <spec>    Output layout, e.g. uploader/date/id2" << endl;
+    cout << "                         (default: the layout saved in the output directory)" << endl;
+    cout << "  " << program << " --worker <queue-dir> [--lease-seconds <n>] [--verbose]" << endl;
+    cout << "  " << program << " --queue-status <queue-dir>" << endl;
+}
+
+// Handles the shared queue commands, returns the process exit code
+int runQueueCommand(const vector<string>& args, const string& program) {
+    if (args.size() < 2) {
+        printUsage(program);
+        return 1;
+    }
+
+    const string& command = args[0];
+    const string& queueDir = args[1];
+    InputValidator validator;
+
+    if (command == "--enqueue" && args.size() >= 3) {
+        QueueJob job;
+        job.url = validator.trimString(args[2]);
+        for (size_t i = 3; i < args.size(); ++i) {
+            bool hasValue = i + 1 < args.size();
+            if (args[i] == "--audio") {
+                job.audioOnly = true;
+                job.format = "mp3";
+            } else if (args[i] == "--quality" && hasValue) {
+                job.quality = atoi(args[++i].c_str());
+            } else if (args[i] == "--format" && hasValue) {
+                job.format = validator.toLowerCase(args[++i]);
+            } else if (args[i] == "--output" && hasValue) {
+                job.outputDir = args[++i];
+            } else if (args[i] == "--layout" && hasValue) {
+                job.layout = args[++i];
+            } else {
+                printUsage(program);
+                return 1;
+            }
+        }
+
+        if (!validator.isValidURL(job.url)) {
+            cerr << "❌ Invalid URL: " << job.url << endl;
+            return 1;
+        }
+        if (!validator.isValidQuality(job.quality) || (!job.audioOnly && !validator.isValidFormat(job.format))) {
+            cerr << "❌ Invalid quality or format" << endl;
+            return 1;
+        }
+        if (!job.layout.empty()) {
+            job.layout = OutputLayout::fromSpec(job.layout).toSpec();
+        }
+
+        // Playlists and channels become one job per video, so the videos are
+        // spread over all workers and a failure only retries that video
+        vector<string> urls;
+        if (validator.extractVideoId(job.url).empty()) {
+            cout << "📋 Listing videos..." << endl;
+            VideoDownloader lister(FileSystemManager::detectDownloaderPath(), nullptr);
+            for (const string& videoId : lister.listVideoIds(job.url)) {
+                urls.push_back("https://www.youtube.com/watch?v=" + videoId);
+            }
+        }
+        if (urls.empty()) {
+            urls.push_back(job.url);
+        }
+
+        SharedWorkQueue queue(queueDir);
+        size_t queued = 0;
+        for (const string& url : urls) {
+            job.url = url;
+            string jobId = queue.enqueue(job);
+            if (queue.isFinished(jobId)) {
+                cout << "ℹ️ Job " << jobId << " (" << url << ") has already finished" << endl;
+            } else {
+                cout << "📥 Queued job " << jobId << " (" << url << ")" << endl;
+                queued++;
+            }
+        }
+        if (urls.size() > 1) {
+            cout << "📥 " << queued << " of " << urls.size() << " videos queued" << endl;
+        }
+        return 0;
+    }
+
+    if (command == "--worker") {
+        int leaseSeconds = 60;
+        bool verbose = false;
+        for (size_t i = 2; i < args.size(); ++i) {
+            if (args[i] == "--lease-seconds" && i + 1 < args.size()) {
+                leaseSeconds = max(3, atoi(args[++i].c_str()));
+            } else if (args[i] == "--verbose") {
+                verbose = true;
+            } else {
+                printUsage(program);
+                return 1;
+            }
+        }
+
+        QueueWorker worker(queueDir, leaseSeconds, verbose);
+        return worker.run();
+    }
+
+    if (command == "--queue-status") {
+        SharedWorkQueue queue(queueDir);
+        QueueStatus status = queue.status();
+        cout << "📊 Queue: " << queueDir << endl;
+        cout << "Total:     " << status.total << endl;
+        cout << "Completed: " << status.completed << endl;
+        cout << "Failed:    " << status.failed << endl;
+        cout << "Running:   " << status.running << endl;
+        cout << "Waiting:   " << status.waiting << endl;
+        return 0;
+    }
+
+    printUsage(program);
+    return 1;
+}
+
 // ===============================================
 // Main Function
 // ===============================================
-int main() {
+int main(int argc, char* argv[]) {
+    // Shared queue commands run without the interactive menu
+    if (argc > 1) {
+        try {
+            return runQueueCommand(vector<string>(argv + 1, argv + argc), argv[0]);
+        } catch (const exception& e) {
+            cerr << "❌ Fatal error: " << e.what() << endl;
+            return 1;
+        }
+    }
+    
     try {
         // Setup UTF-8 encoding for console
         #ifdef _WIN32